@@ -0,0 +1,232 @@
+/*
+ * blockcache.c - Source file
+ * Cache of decrypted 512B blocks shared between processes. The cache lives in
+ * shared memory, lookups are lock-free and blocks are evicted by the clock policy.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "blockcache.h"
+
+/*
+ * Slot is guarded by sequence number. Writer makes it odd while the slot is
+ * rewritten, reader reports miss when the number changed during the copy.
+ * Zero marks slot which was never written.
+ */
+struct cache_slot {
+    uint32_t seq;
+    uint32_t ref;
+    struct cache_tag tag;
+    uint8_t data[CACHE_BLOCK_SIZE];
+};
+
+struct cache_set {
+    uint32_t hand;
+    uint32_t pad;
+    struct cache_slot slot[CACHE_WAYS];
+};
+
+struct block_cache {
+    struct cache_set *sets;
+    uint32_t count;
+    size_t size;
+};
+
+static uint32_t tag_hash(const struct cache_tag *tag)
+{
+    uint64_t h = 0;
+
+    h = (h ^ tag->dev)    * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ tag->ino)    * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ tag->mtime)  * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ tag->index)  * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ tag->key_id) * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t) (h >> 32);
+}
+
+static struct block_cache *cache_map(int fd, size_t size)
+{
+    struct block_cache *cache;
+    int flags = (fd < 0) ? MAP_SHARED | MAP_ANONYMOUS : MAP_SHARED;
+
+    cache = malloc(sizeof(struct block_cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    cache->sets = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (cache->sets == MAP_FAILED)
+    {
+        free(cache);
+        return NULL;
+    }
+
+    cache->count = size / sizeof(struct cache_set);
+    cache->size = size;
+    return cache;
+}
+
+struct block_cache *cache_create(uint32_t sets)
+{
+    if (sets == 0)
+    {
+        return NULL;
+    }
+    return cache_map(-1, (size_t) sets * sizeof(struct cache_set));
+}
+
+struct block_cache *cache_open(const char *name, uint32_t sets)
+{
+    struct block_cache *cache;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    // the first process sizes the cache, the others take the existing size
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && sets > 0)
+    {
+        if (ftruncate(fd, (off_t) sets * sizeof(struct cache_set)) != 0)
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct cache_set))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    cache = cache_map(fd, st.st_size);
+    close(fd);
+    return cache;
+}
+
+void cache_close(struct block_cache *cache)
+{
+    munmap(cache->sets, cache->size);
+    free(cache);
+}
+
+int cache_unlink(const char *name)
+{
+    return shm_unlink(name) != 0;
+}
+
+/*
+ * The slot is copied aside first, caller's block is written only when the
+ * copy is known to be consistent, so a miss leaves it untouched.
+ */
+static int slot_read(struct cache_slot *slot, const struct cache_tag *tag, uint8_t *block)
+{
+    uint8_t data[CACHE_BLOCK_SIZE];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    if (seq == 0 || (seq & 1))
+    {
+        return 0;
+    }
+
+    if (memcmp(&slot->tag, tag, sizeof(struct cache_tag)) != 0)
+    {
+        return 0;
+    }
+
+    if (block != NULL)
+    {
+        memcpy(data, slot->data, CACHE_BLOCK_SIZE);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+    {
+        return 0;
+    }
+
+    if (block != NULL)
+    {
+        memcpy(block, data, CACHE_BLOCK_SIZE);
+    }
+    return 1;
+}
+
+int cache_lookup(struct block_cache *cache, const struct cache_tag *tag, uint8_t *block)
+{
+    struct cache_set *set = &cache->sets[tag_hash(tag) % cache->count];
+    int i;
+
+    for (i = 0; i < CACHE_WAYS; i++)
+    {
+        struct cache_slot *slot = &set->slot[i];
+
+        if (slot_read(slot, tag, block))
+        {
+            // avoid dirtying the shared line when the bit is already set
+            if (__atomic_load_n(&slot->ref, __ATOMIC_RELAXED) == 0)
+            {
+                __atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void cache_insert(struct block_cache *cache, const struct cache_tag *tag, const uint8_t *block)
+{
+    struct cache_set *set = &cache->sets[tag_hash(tag) % cache->count];
+    int i;
+
+    // another process might have inserted the block meanwhile
+    for (i = 0; i < CACHE_WAYS; i++)
+    {
+        if (slot_read(&set->slot[i], tag, NULL))
+        {
+            return;
+        }
+    }
+
+    // clock sweep, each slot gets the second chance when it was referenced
+    for (i = 0; i < 2 * CACHE_WAYS; i++)
+    {
+        uint32_t hand = __atomic_fetch_add(&set->hand, 1, __ATOMIC_RELAXED);
+        struct cache_slot *slot = &set->slot[hand % CACHE_WAYS];
+        uint32_t seq;
+
+        if (__atomic_load_n(&slot->ref, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&slot->ref, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+
+        // odd sequence number must be visible before the slot is rewritten
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(&slot->tag, tag, sizeof(struct cache_tag));
+        memcpy(slot->data, block, CACHE_BLOCK_SIZE);
+        __atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+        return;
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * blockcache.h - Header file
+ * Cache of decrypted 512B blocks shared between processes. The cache lives in
+ * shared memory, lookups are lock-free and blocks are evicted by the clock policy.
+ */
+
+#include <stdint.h>
+
+#define CACHE_BLOCK_SIZE 512
+#define CACHE_WAYS 8
+
+/*
+ * Identity of a cached block.
+ * Items:
+ *   dev, ino - file the block was read from
+ *   mtime    - modification time of the file, cached blocks of rewritten files are not matched
+ *   index    - index of the block in the file
+ *   key_id   - identifier of the key the block was decrypted with
+ */
+struct cache_tag {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t mtime;
+    uint64_t index;
+    uint64_t key_id;
+};
+
+struct block_cache;
+
+/*
+ * Create anonymous cache shared with the processes forked afterwards.
+ * Params:
+ *   sets - number of sets, each set holds CACHE_WAYS blocks
+ * Returns NULL on error.
+ */
+struct block_cache *cache_create(uint32_t sets);
+
+/*
+ * Open named cache, the cache is created when it does not exist yet.
+ * Params:
+ *   name - name of the shared memory object (see shm_open)
+ *   sets - number of sets of the newly created cache
+ * Returns NULL on error.
+ */
+struct block_cache *cache_open(const char *name, uint32_t sets);
+
+/*
+ * Unmap the cache. Blocks stay cached for other processes.
+ * Params:
+ *   cache - cache to be closed
+ */
+void cache_close(struct block_cache *cache);
+
+/*
+ * Remove named cache. Processes which have it opened keep using it, its
+ * memory is released after the last of them closes it.
+ * Params:
+ *   name - name of the shared memory object (see shm_open)
+ * Returns 0 on success, 1 on error.
+ */
+int cache_unlink(const char *name);
+
+/*
+ * Look up decrypted block.
+ * Params:
+ *   cache - cache to be searched
+ *   tag   - identity of the block
+ *   block - CACHE_BLOCK_SIZE bytes the decrypted block is copied to
+ * Returns 1 on hit, 0 on miss.
+ */
+int cache_lookup(struct block_cache *cache, const struct cache_tag *tag, uint8_t *block);
+
+/*
+ * Insert decrypted block. Insertion is skipped when all candidate slots are
+ * being written by other processes.
+ * Params:
+ *   cache - cache the block is inserted into
+ *   tag   - identity of the block
+ *   block - CACHE_BLOCK_SIZE bytes of decrypted data
+ */
+void cache_insert(struct block_cache *cache, const struct cache_tag *tag, const uint8_t *block);
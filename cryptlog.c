@@ -0,0 +1,532 @@
+/*
+ * cryptlog.c - Source file
+ * Writer of encrypted append-only log. Records are framed by their 32b length,
+ * the stream is ciphered in 512B blocks by XXTEA, the same way as xxtea does,
+ * so the log can be decrypted by `xxtea -d`. Each block starts with a header
+ * pointing to its first frame, so the end of the log is found from its tail.
+ * The last partial block is padded by zeros and re-encrypted as it fills.
+ * Commits of concurrent appenders share one write and one fsync (group commit).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "crypto.h"
+#include "cryptlog.h"
+
+#define LOG_BLOCK_SIZE 512
+#define LOG_BLOCK_WORDS 128
+#define LOG_BUF_BLOCKS 64
+#define LOG_HEADER_LEN 4
+#define LOG_FRAME_LEN 4
+#define LOG_NO_FRAME 0xFFFF
+#define LOG_MAGIC 0x4C47
+
+/*
+ * Every block starts with header of two 16b values, the offset of the first
+ * frame starting in the block (LOG_NO_FRAME when the block only continues
+ * a record) and LOG_MAGIC xor the block index. Records continue across blocks
+ * skipping the headers. Frame header never crosses the block boundary, when
+ * less than LOG_FRAME_LEN bytes remain in the block they are zero and the frame
+ * starts in the next one. Zero length marks the padding of the last block.
+ */
+struct cryptlog {
+    int fd;
+    uint32_t key[4];
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    uint8_t *buf;       // plain data not yet durable, starts at block boundary
+    size_t len;
+    size_t cap;
+    uint8_t *out;       // ciphered blocks, used by flushing thread only
+    size_t out_cap;
+    uint64_t base;      // log position of buf[0]
+    uint64_t durable;   // log position synced to disk
+    int flushing;
+    int error;
+};
+
+static int reserve(uint8_t **buf, size_t *cap, size_t size)
+{
+    uint8_t *tmp;
+    size_t new_cap = *cap;
+
+    if (size <= *cap)
+    {
+        return 0;
+    }
+
+    while (new_cap < size)
+    {
+        new_cap *= 2;
+    }
+
+    tmp = realloc(*buf, new_cap);
+    if (tmp == NULL)
+    {
+        return 1;
+    }
+
+    *buf = tmp;
+    *cap = new_cap;
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t size, uint64_t offset)
+{
+    ssize_t done;
+
+    while (size > 0)
+    {
+        done = pwrite(fd, data, size, offset);
+        if (done <= 0)
+        {
+            return 1;
+        }
+        data += done;
+        size -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+static int read_all(int fd, uint8_t *data, size_t size, uint64_t offset)
+{
+    ssize_t done;
+
+    while (size > 0)
+    {
+        done = pread(fd, data, size, offset);
+        if (done <= 0)
+        {
+            return 1;
+        }
+        data += done;
+        size -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+static int read_blocks(struct cryptlog *wr, uint8_t *data, uint64_t index, uint64_t count)
+{
+    if (read_all(wr->fd, data, count * LOG_BLOCK_SIZE, index * LOG_BLOCK_SIZE) != 0)
+    {
+        return 1;
+    }
+    decrypt_blocks((uint32_t *) data, LOG_BLOCK_WORDS, count, wr->key);
+    return 0;
+}
+
+/*
+ * Returns the offset of the first frame in decrypted block, LOG_NO_FRAME when
+ * there is none or -1 when the block is not the index-th block of the log.
+ */
+static int block_first(const uint8_t *block, uint64_t index)
+{
+    uint16_t first, check;
+
+    memcpy(&first, block, sizeof(first));
+    memcpy(&check, block + sizeof(first), sizeof(check));
+
+    if (check != (uint16_t) (LOG_MAGIC ^ index))
+    {
+        return -1;
+    }
+    if (first != LOG_NO_FRAME && (first < LOG_HEADER_LEN || first > LOG_BLOCK_SIZE - LOG_FRAME_LEN))
+    {
+        return -1;
+    }
+    return first;
+}
+
+/*
+ * Log position of the frame header following position pos.
+ */
+static uint64_t frame_start(uint64_t pos)
+{
+    uint64_t in = pos % LOG_BLOCK_SIZE;
+
+    if (in < LOG_HEADER_LEN)
+    {
+        return pos - in + LOG_HEADER_LEN;
+    }
+    if (LOG_BLOCK_SIZE - in < LOG_FRAME_LEN)
+    {
+        return pos - in + LOG_BLOCK_SIZE + LOG_HEADER_LEN;
+    }
+    return pos;
+}
+
+/*
+ * Log position after len bytes of record starting at pos, block headers
+ * are skipped.
+ */
+static uint64_t record_end(uint64_t pos, uint64_t len)
+{
+    uint64_t in = pos % LOG_BLOCK_SIZE;
+    uint64_t blocks;
+
+    if (in == 0)
+    {
+        pos += LOG_HEADER_LEN;
+        in = LOG_HEADER_LEN;
+    }
+    if (len <= LOG_BLOCK_SIZE - in)
+    {
+        return pos + len;
+    }
+
+    len -= LOG_BLOCK_SIZE - in;
+    pos += LOG_BLOCK_SIZE - in;
+    blocks = (len - 1) / (LOG_BLOCK_SIZE - LOG_HEADER_LEN);
+    len -= blocks * (LOG_BLOCK_SIZE - LOG_HEADER_LEN);
+    return pos + blocks * LOG_BLOCK_SIZE + LOG_HEADER_LEN + len;
+}
+
+/*
+ * Find the end of the last whole record and load the partial last block into
+ * buffer. Only the blocks from the last one where a frame starts are decrypted.
+ * Blocks torn or left unwritten by a crash and a truncated last record are cut
+ * off, the log is refused only when its first block is not valid, which means
+ * the key is wrong.
+ */
+static int scan(struct cryptlog *wr, uint64_t size)
+{
+    uint8_t block[LOG_BLOCK_SIZE];
+    uint8_t *data;
+    uint64_t count = size / LOG_BLOCK_SIZE;
+    uint64_t first, limit, last, pos, end, i, k, keep;
+    uint32_t len;
+    int marker;
+
+    // empty log, possibly with a torn first write
+    if (count == 0)
+    {
+        return size > 0 && (ftruncate(wr->fd, 0) != 0 || fdatasync(wr->fd) != 0);
+    }
+
+    if (read_blocks(wr, block, 0, 1) != 0 || block_first(block, 0) != LOG_HEADER_LEN)
+    {
+        return 1;
+    }
+
+    // block 0 always starts a frame, so the search stops there at worst
+    for (first = count - 1; first > 0; first--)
+    {
+        if (read_blocks(wr, block, first, 1) != 0)
+        {
+            return 1;
+        }
+        marker = block_first(block, first);
+        if (marker >= 0 && marker != LOG_NO_FRAME)
+        {
+            break;
+        }
+    }
+
+    data = malloc((count - first) * LOG_BLOCK_SIZE);
+    if (data == NULL || read_blocks(wr, data, first, count - first) != 0)
+    {
+        free(data);
+        return 1;
+    }
+
+    // everything from the first invalid block on is garbage
+    for (limit = first + 1; limit < count; limit++)
+    {
+        if (block_first(data + (limit - first) * LOG_BLOCK_SIZE, limit) < 0)
+        {
+            break;
+        }
+    }
+
+    // walk frames, the first frame of each block must be the one its header
+    // points to and blocks a record passes over must have no frame
+    pos = first * LOG_BLOCK_SIZE + block_first(data, first);
+    end = pos;
+    last = first;
+    for (;;)
+    {
+        pos = frame_start(pos);
+        k = pos / LOG_BLOCK_SIZE;
+        if (k >= limit)
+        {
+            break;
+        }
+        if (k != last)
+        {
+            for (i = last + 1; i < k; i++)
+            {
+                if (block_first(data + (i - first) * LOG_BLOCK_SIZE, i) != LOG_NO_FRAME)
+                {
+                    break;
+                }
+            }
+            if (i < k || block_first(data + (k - first) * LOG_BLOCK_SIZE, k) != (int) (pos % LOG_BLOCK_SIZE))
+            {
+                break;
+            }
+        }
+
+        memcpy(&len, data + (pos - first * LOG_BLOCK_SIZE), LOG_FRAME_LEN);
+        if (len == 0)
+        {
+            break;
+        }
+        pos = record_end(pos + LOG_FRAME_LEN, len);
+        if (pos > limit * LOG_BLOCK_SIZE)
+        {
+            break;
+        }
+        end = pos;
+        last = k;
+    }
+
+    k = end / LOG_BLOCK_SIZE;
+    wr->base = k * LOG_BLOCK_SIZE;
+    wr->len = end % LOG_BLOCK_SIZE;
+    wr->durable = end;
+    if (wr->len > 0)
+    {
+        memcpy(wr->buf, data + (k - first) * LOG_BLOCK_SIZE, wr->len);
+
+        // header must not point to a frame which was cut off
+        if (block_first(wr->buf, k) >= (int) wr->len)
+        {
+            uint16_t none = LOG_NO_FRAME;
+
+            memcpy(wr->buf, &none, sizeof(none));
+        }
+    }
+    free(data);
+
+    // the partial last block is rewritten by the next flush, blocks after it go
+    keep = wr->base + ((wr->len > 0) ? LOG_BLOCK_SIZE : 0);
+    if (keep < size && (ftruncate(wr->fd, keep) != 0 || fdatasync(wr->fd) != 0))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+struct cryptlog *cryptlog_open(const char *path, uint32_t *key)
+{
+    struct cryptlog *wr;
+    struct stat st;
+
+    wr = calloc(1, sizeof(struct cryptlog));
+    if (wr == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(wr->key, key, sizeof(wr->key));
+    wr->cap = LOG_BUF_BLOCKS * LOG_BLOCK_SIZE;
+    wr->out_cap = wr->cap;
+    wr->buf = malloc(wr->cap);
+    wr->out = malloc(wr->out_cap);
+    wr->fd = open(path, O_RDWR | O_CREAT, 0600);
+
+    if (wr->buf == NULL || wr->out == NULL || wr->fd < 0
+        || fstat(wr->fd, &st) != 0 || scan(wr, st.st_size) != 0)
+    {
+        if (wr->fd >= 0)
+        {
+            close(wr->fd);
+        }
+        free(wr->buf);
+        free(wr->out);
+        free(wr);
+        return NULL;
+    }
+
+    pthread_mutex_init(&wr->lock, NULL);
+    pthread_cond_init(&wr->flushed, NULL);
+    return wr;
+}
+
+/*
+ * Start the next block by its header, the buffer ends at block boundary.
+ */
+static void begin_block(struct cryptlog *wr)
+{
+    uint16_t first = LOG_NO_FRAME;
+    uint16_t check = (uint16_t) (LOG_MAGIC ^ ((wr->base + wr->len) / LOG_BLOCK_SIZE));
+
+    memcpy(wr->buf + wr->len, &first, sizeof(first));
+    memcpy(wr->buf + wr->len + sizeof(first), &check, sizeof(check));
+    wr->len += LOG_HEADER_LEN;
+}
+
+int cryptlog_append(struct cryptlog *wr, const void *record, uint32_t len, uint64_t *lsn)
+{
+    uint8_t *block;
+    uint16_t first;
+    size_t in, n, done;
+
+    if (len == 0)
+    {
+        return 1;
+    }
+
+    pthread_mutex_lock(&wr->lock);
+
+    // padding and header before the frame, header of each block of the record
+    if (wr->error || reserve(&wr->buf, &wr->cap, wr->len + LOG_BLOCK_SIZE + LOG_FRAME_LEN + len
+                             + (len / (LOG_BLOCK_SIZE - LOG_HEADER_LEN) + 1) * LOG_HEADER_LEN) != 0)
+    {
+        pthread_mutex_unlock(&wr->lock);
+        return 1;
+    }
+
+    in = wr->len % LOG_BLOCK_SIZE;
+    if (in != 0 && LOG_BLOCK_SIZE - in < LOG_FRAME_LEN)
+    {
+        memset(wr->buf + wr->len, 0, LOG_BLOCK_SIZE - in);
+        wr->len += LOG_BLOCK_SIZE - in;
+        in = 0;
+    }
+    if (in == 0)
+    {
+        begin_block(wr);
+        in = LOG_HEADER_LEN;
+    }
+
+    block = wr->buf + wr->len - in;
+    memcpy(&first, block, sizeof(first));
+    if (first == LOG_NO_FRAME)
+    {
+        first = in;
+        memcpy(block, &first, sizeof(first));
+    }
+
+    memcpy(wr->buf + wr->len, &len, LOG_FRAME_LEN);
+    wr->len += LOG_FRAME_LEN;
+
+    for (done = 0; done < len; done += n)
+    {
+        if (wr->len % LOG_BLOCK_SIZE == 0)
+        {
+            begin_block(wr);
+        }
+        n = LOG_BLOCK_SIZE - wr->len % LOG_BLOCK_SIZE;
+        if (n > len - done)
+        {
+            n = len - done;
+        }
+        memcpy(wr->buf + wr->len, (const uint8_t *) record + done, n);
+        wr->len += n;
+    }
+
+    if (lsn != NULL)
+    {
+        *lsn = wr->base + wr->len;
+    }
+
+    pthread_mutex_unlock(&wr->lock);
+    return 0;
+}
+
+/*
+ * Write and sync everything buffered so far. Called with the lock held and
+ * the flushing flag set, the lock is released while ciphering and writing,
+ * so other threads keep appending.
+ */
+static void flush(struct cryptlog *wr)
+{
+    uint64_t start = wr->base;
+    size_t size = wr->len;
+    size_t padded = (size + LOG_BLOCK_SIZE - 1) / LOG_BLOCK_SIZE * LOG_BLOCK_SIZE;
+    size_t full = size / LOG_BLOCK_SIZE * LOG_BLOCK_SIZE;
+    size_t i;
+    int rc;
+
+    if (reserve(&wr->out, &wr->out_cap, padded) != 0)
+    {
+        wr->error = 1;
+        return;
+    }
+
+    memcpy(wr->out, wr->buf, size);
+    memset(wr->out + size, 0, padded - size);
+
+    pthread_mutex_unlock(&wr->lock);
+
+    for (i = 0; i < padded; i += LOG_BLOCK_SIZE)
+    {
+        crypt((uint32_t *) (wr->out + i), LOG_BLOCK_WORDS, wr->key);
+    }
+
+    rc = write_all(wr->fd, wr->out, padded, start);
+    if (rc == 0)
+    {
+        rc = fdatasync(wr->fd);
+    }
+
+    pthread_mutex_lock(&wr->lock);
+
+    if (rc != 0)
+    {
+        wr->error = 1;
+        return;
+    }
+
+    // full blocks are final, the partial one stays buffered to be rewritten
+    memmove(wr->buf, wr->buf + full, wr->len - full);
+    wr->len -= full;
+    wr->base += full;
+    wr->durable = start + size;
+}
+
+int cryptlog_commit(struct cryptlog *wr, uint64_t lsn)
+{
+    int rc;
+
+    pthread_mutex_lock(&wr->lock);
+
+    while (!wr->error && wr->durable < lsn)
+    {
+        if (wr->flushing)
+        {
+            pthread_cond_wait(&wr->flushed, &wr->lock);
+            continue;
+        }
+
+        wr->flushing = 1;
+        flush(wr);
+        wr->flushing = 0;
+        pthread_cond_broadcast(&wr->flushed);
+    }
+
+    rc = wr->error;
+    pthread_mutex_unlock(&wr->lock);
+    return rc;
+}
+
+int cryptlog_close(struct cryptlog *wr)
+{
+    uint64_t end;
+    int rc;
+
+    pthread_mutex_lock(&wr->lock);
+    end = wr->base + wr->len;
+    pthread_mutex_unlock(&wr->lock);
+
+    rc = cryptlog_commit(wr, end);
+    if (close(wr->fd) != 0)
+    {
+        rc = 1;
+    }
+
+    pthread_cond_destroy(&wr->flushed);
+    pthread_mutex_destroy(&wr->lock);
+    free(wr->buf);
+    free(wr->out);
+    free(wr);
+    return rc;
+}
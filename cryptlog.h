@@ -0,0 +1,55 @@
+/*
+ * cryptlog.h - Header file
+ * Writer of encrypted append-only log. Records are framed by their 32b length,
+ * the stream is ciphered in 512B blocks by XXTEA, the same way as xxtea does,
+ * so the log can be decrypted by `xxtea -d`. Each block starts with a header
+ * pointing to its first frame, so the end of the log is found from its tail.
+ * The last partial block is padded by zeros and re-encrypted as it fills.
+ * Commits of concurrent appenders share one write and one fsync (group commit).
+ */
+
+#include <stdint.h>
+
+struct cryptlog;
+
+/*
+ * Open log for appending, the log is created when it does not exist.
+ * Only the blocks from the last one where a record starts are decrypted,
+ * so the cost depends on the length of the last record, not of the log.
+ * Blocks torn by a crash and a truncated last record are cut off.
+ * Params:
+ *   path - log file
+ *   key  - 128b key
+ * Returns NULL on error or when the first block can't be decrypted by key.
+ */
+struct cryptlog *cryptlog_open(const char *path, uint32_t *key);
+
+/*
+ * Append record into the log buffer. The record is not written until it is
+ * committed. Safe to be called from several threads.
+ * Params:
+ *   wr     - opened log
+ *   record - record data
+ *   len    - length of record, must not be zero
+ *   lsn    - if not NULL, log position after the record is stored there
+ * Returns 0 on success, 1 on error.
+ */
+int cryptlog_append(struct cryptlog *wr, const void *record, uint32_t len, uint64_t *lsn);
+
+/*
+ * Wait until the log is durable up to given position. One of the waiting
+ * threads writes and syncs the records of all of them.
+ * Params:
+ *   wr  - opened log
+ *   lsn - position returned by cryptlog_append
+ * Returns 0 on success, 1 on error.
+ */
+int cryptlog_commit(struct cryptlog *wr, uint64_t lsn);
+
+/*
+ * Commit all appended records and close the log.
+ * Params:
+ *   wr - opened log
+ * Returns 0 on success, 1 on error.
+ */
+int cryptlog_close(struct cryptlog *wr);
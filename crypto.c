@@ -10,8 +10,14 @@
 #include <stdint.h>
 #include "crypto.h"
 
+#define MX(z, y, sum, k) (((z>>5^y<<2) + (y>>3^z<<4)) ^ ((sum^y) + (k^z)))
+
 /*
  * Decrypt block by XXTEA.
+ * Rounds must go from the end of the block, as each word is decrypted with
+ * its already decrypted successor. The successor and the decrypted last word
+ * are kept in registers, key words are selected once per round and the loop
+ * is unrolled by 4 so that their indexes are constant.
  * Params:
  *   block - block of encrypted data
  *   len   - length of block
@@ -19,26 +25,118 @@
  */
 void decrypt(uint32_t *block, uint32_t len, uint32_t *key)
 {
-    uint32_t z=block[len-1], y=block[0], sum=0, e, DELTA=0x9e3779b9;
+    uint32_t z, y=block[0], last, sum=0, e, k[4], DELTA=0x9e3779b9;
     int32_t p, q;
     
     q = 6 + 52/len;
     sum = q*DELTA ;
+    
+    // single word is its own neighbour, there is no window to slide
+    if (len < 2) {
+        while (sum != 0) {
+            e = (sum >> 2) & 3;
+            y = block[0] -= MX(y, y, sum, key[e]);
+            sum -= DELTA;
+        }
+        return;
+    }
+    
     while (sum != 0) {
         e = (sum >> 2) & 3;
-        for (p=len-1; p>0; p--)
+        k[0] = key[0^e];
+        k[1] = key[1^e];
+        k[2] = key[2^e];
+        k[3] = key[3^e];
+        
+        z = block[len-2];
+        last = block[len-1] -= MX(z, y, sum, k[(len-1)&3]);
+        y = last;
+        
+        for (p=len-2; p>0 && (p&3) != 3; p--)
         {
             z = block[p-1];
-            block[p] -= (z>>5^y<<2) + (y>>3^z<<4)^(sum^y) + (key[p&3^e]^z);
-            y = block[p];
+            y = block[p] -= MX(z, y, sum, k[p&3]);
         }
-        z = block[len-1];
-        block[0] -= (z>>5^y<<2) + (y>>3^z<<4)^(sum^y) + (key[p&3^e]^z);
-        y =  block[0];
+        for (; p>=4; p-=4)
+        {
+            z = block[p-1];
+            y = block[p] -= MX(z, y, sum, k[3]);
+            z = block[p-2];
+            y = block[p-1] -= MX(z, y, sum, k[2]);
+            z = block[p-3];
+            y = block[p-2] -= MX(z, y, sum, k[1]);
+            z = block[p-4];
+            y = block[p-3] -= MX(z, y, sum, k[0]);
+        }
+        for (; p>0; p--)
+        {
+            z = block[p-1];
+            y = block[p] -= MX(z, y, sum, k[p&3]);
+        }
+        
+        y = block[0] -= MX(last, y, sum, k[0]);
         sum -= DELTA;
     }
 }
 
+/*
+ * Decrypt consecutive blocks by XXTEA.
+ * Blocks are taken in pairs whose rounds are interleaved, so the two
+ * independent dependency chains overlap in the pipeline.
+ * Params:
+ *   blocks - consecutive blocks of encrypted data
+ *   len    - length of one block
+ *   count  - number of blocks
+ *   key    - 128b key
+ */
+void decrypt_blocks(uint32_t *blocks, uint32_t len, uint32_t count, uint32_t *key)
+{
+    uint32_t za, ya, lasta, zb, yb, lastb, sum, e, k, DELTA=0x9e3779b9;
+    uint32_t *a, *b;
+    int32_t p, q;
+    
+    for (; count >= 2 && len >= 2; count -= 2, blocks += 2*len)
+    {
+        a = blocks;
+        b = blocks + len;
+        ya = a[0];
+        yb = b[0];
+        
+        q = 6 + 52/len;
+        sum = q*DELTA ;
+        while (sum != 0) {
+            e = (sum >> 2) & 3;
+            
+            k = key[(len-1)&3^e];
+            za = a[len-2];
+            zb = b[len-2];
+            lasta = a[len-1] -= MX(za, ya, sum, k);
+            lastb = b[len-1] -= MX(zb, yb, sum, k);
+            ya = lasta;
+            yb = lastb;
+            
+            for (p=len-2; p>0; p--)
+            {
+                k = key[p&3^e];
+                za = a[p-1];
+                zb = b[p-1];
+                ya = a[p] -= MX(za, ya, sum, k);
+                yb = b[p] -= MX(zb, yb, sum, k);
+            }
+            
+            k = key[e];
+            ya = a[0] -= MX(lasta, ya, sum, k);
+            yb = b[0] -= MX(lastb, yb, sum, k);
+            sum -= DELTA;
+        }
+    }
+    
+    for (; count > 0; count--, blocks += len)
+    {
+        decrypt(blocks, len, key);
+    }
+}
+
 /*
  * Crypt block by XXTEA.
  * Params:
@@ -65,4 +163,52 @@ void crypt(uint32_t *block, uint32_t len, uint32_t *key)
         block[len-1] += (z>>5^y<<2) + (y>>3^z<<4)^(sum^y) + (key[p&3^e]^z);
         z = block[len-1];
     }
-}
\ No newline at end of file
+}
+
+/*
+ * Crypt consecutive blocks by XXTEA.
+ * Blocks are taken in pairs whose rounds are interleaved, so the two
+ * independent dependency chains overlap in the pipeline.
+ * Params:
+ *   blocks - consecutive blocks of input data
+ *   len    - length of one block
+ *   count  - number of blocks
+ *   key    - 128b key
+ */
+void crypt_blocks(uint32_t *blocks, uint32_t len, uint32_t count, uint32_t *key)
+{
+    uint32_t za, ya, zb, yb, sum, e, k, DELTA=0x9e3779b9;
+    uint32_t *a, *b;
+    int32_t p, q;
+    
+    for (; count >= 2; count -= 2, blocks += 2*len)
+    {
+        a = blocks;
+        b = blocks + len;
+        za = a[len-1];
+        zb = b[len-1];
+        sum = 0;
+        
+        q = 6 + 52/len;
+        while (q-- > 0) {
+            sum += DELTA;
+            e = (sum >> 2) & 3;
+            for (p=0; p<len-1; p++)
+            {
+                k = key[p&3^e];
+                ya = a[p+1];
+                yb = b[p+1];
+                za = a[p] += MX(za, ya, sum, k);
+                zb = b[p] += MX(zb, yb, sum, k);
+            }
+            k = key[p&3^e];
+            za = a[len-1] += MX(za, a[0], sum, k);
+            zb = b[len-1] += MX(zb, b[0], sum, k);
+        }
+    }
+    
+    if (count > 0)
+    {
+        crypt(blocks, len, key);
+    }
+}
@@ -18,6 +18,16 @@
  */
 void decrypt(uint32_t *block, uint32_t len, uint32_t *key);
 
+/*
+ * Decrypt consecutive blocks by XXTEA.
+ * Params:
+ *   blocks - consecutive blocks of encrypted data
+ *   len    - length of one block
+ *   count  - number of blocks
+ *   key    - 128b key
+ */
+void decrypt_blocks(uint32_t *blocks, uint32_t len, uint32_t count, uint32_t *key);
+
 /*
  * Crypt block by XXTEA.
  * Params:
@@ -26,3 +36,13 @@ void decrypt(uint32_t *block, uint32_t len, uint32_t *key);
  *   key   - 128b key
  */
 void crypt(uint32_t *block, uint32_t len, uint32_t *key);
+
+/*
+ * Crypt consecutive blocks by XXTEA.
+ * Params:
+ *   blocks - consecutive blocks of input data
+ *   len    - length of one block
+ *   count  - number of blocks
+ *   key    - 128b key
+ */
+void crypt_blocks(uint32_t *blocks, uint32_t len, uint32_t count, uint32_t *key);
@@ -0,0 +1,303 @@
+/*
+ * stream.c - Source file
+ * Crypt or decrypt stream in parallel. Reader splits the input into
+ * sequence-numbered chunks, worker threads cipher them and the chunks are
+ * written out in the order of their sequence numbers.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "crypto.h"
+#include "stream.h"
+
+#define STREAM_BLOCK_SIZE 512
+#define STREAM_BLOCK_WORDS 128
+#define STREAM_CHUNK_BLOCKS 256
+#define STREAM_CHUNK_SIZE (STREAM_CHUNK_BLOCKS * STREAM_BLOCK_SIZE)
+#define STREAM_PAD '0'
+
+#define CHUNK_FREE 0
+#define CHUNK_READ 1
+#define CHUNK_DONE 2
+
+struct chunk {
+    uint8_t *data;
+    size_t size;
+    int state;
+};
+
+/*
+ * Chunk with sequence number s lives in ring slot s % slots. Reader may run
+ * at most slots chunks ahead of writer, workers take chunks in sequence order
+ * but finish them in any order.
+ */
+struct stream {
+    FILE *in;
+    FILE *out;
+    uint32_t *key;
+    int decrypting;
+    const uint8_t *head;
+    size_t head_size;
+    struct chunk *ring;
+    uint32_t slots;
+    uint64_t next_read;
+    uint64_t next_work;
+    uint64_t next_write;
+    int eof;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+static void set_error(struct stream *s, int error)
+{
+    pthread_mutex_lock(&s->lock);
+    if (s->error == STREAM_OK)
+    {
+        s->error = error;
+    }
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Only short read tells the end of input, so the last partial block is
+ * recognized even when the input is a pipe.
+ */
+static void *reader(void *arg)
+{
+    struct stream *s = arg;
+    struct chunk *chunk;
+    size_t size;
+    int last;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&s->lock);
+        while (s->error == STREAM_OK && s->next_read - s->next_write >= s->slots)
+        {
+            pthread_cond_wait(&s->changed, &s->lock);
+        }
+        if (s->error != STREAM_OK)
+        {
+            pthread_mutex_unlock(&s->lock);
+            return NULL;
+        }
+        chunk = &s->ring[s->next_read % s->slots];
+        pthread_mutex_unlock(&s->lock);
+
+        size = 0;
+        if (s->head_size > 0)
+        {
+            memcpy(chunk->data, s->head, s->head_size);
+            size = s->head_size;
+            s->head_size = 0;
+        }
+        size += fread(chunk->data + size, sizeof(uint8_t), STREAM_CHUNK_SIZE - size, s->in);
+
+        last = size < STREAM_CHUNK_SIZE;
+        if (last && ferror(s->in))
+        {
+            set_error(s, STREAM_READ_ERROR);
+            return NULL;
+        }
+
+        if (s->decrypting)
+        {
+            size -= size % STREAM_BLOCK_SIZE;
+        }
+        else if (size % STREAM_BLOCK_SIZE != 0)
+        {
+            memset(chunk->data + size, STREAM_PAD, STREAM_BLOCK_SIZE - size % STREAM_BLOCK_SIZE);
+            size += STREAM_BLOCK_SIZE - size % STREAM_BLOCK_SIZE;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        if (size > 0)
+        {
+            chunk->size = size;
+            chunk->state = CHUNK_READ;
+            s->next_read++;
+        }
+        s->eof = last;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+
+        if (last)
+        {
+            return NULL;
+        }
+    }
+}
+
+static void *worker(void *arg)
+{
+    struct stream *s = arg;
+    struct chunk *chunk;
+    uint32_t count;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&s->lock);
+        while (s->error == STREAM_OK && s->next_work == s->next_read && !s->eof)
+        {
+            pthread_cond_wait(&s->changed, &s->lock);
+        }
+        if (s->error != STREAM_OK || s->next_work == s->next_read)
+        {
+            pthread_mutex_unlock(&s->lock);
+            return NULL;
+        }
+        chunk = &s->ring[s->next_work % s->slots];
+        s->next_work++;
+        pthread_mutex_unlock(&s->lock);
+
+        count = chunk->size / STREAM_BLOCK_SIZE;
+        if (s->decrypting)
+        {
+            decrypt_blocks((uint32_t *) chunk->data, STREAM_BLOCK_WORDS, count, s->key);
+        }
+        else
+        {
+            crypt_blocks((uint32_t *) chunk->data, STREAM_BLOCK_WORDS, count, s->key);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        chunk->state = CHUNK_DONE;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/*
+ * Write ciphered chunks in sequence order, runs in the calling thread.
+ */
+static void writer(struct stream *s)
+{
+    struct chunk *chunk;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&s->lock);
+        while (s->error == STREAM_OK
+               && !(s->next_write < s->next_read && s->ring[s->next_write % s->slots].state == CHUNK_DONE)
+               && !(s->eof && s->next_write == s->next_read))
+        {
+            pthread_cond_wait(&s->changed, &s->lock);
+        }
+        if (s->error != STREAM_OK || s->next_write == s->next_read)
+        {
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+        chunk = &s->ring[s->next_write % s->slots];
+        pthread_mutex_unlock(&s->lock);
+
+        if (fwrite(chunk->data, sizeof(uint8_t), chunk->size, s->out) < chunk->size)
+        {
+            set_error(s, STREAM_WRITE_ERROR);
+            return;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        chunk->state = CHUNK_FREE;
+        s->next_write++;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+int cipher_stream(FILE *in, FILE *out, uint32_t *key, int decrypting, int threads,
+                  const uint8_t *head, size_t head_size)
+{
+    struct stream s;
+    pthread_t *workers;
+    pthread_t read_thread;
+    int started = 0;
+    int read_started = 0;
+    uint32_t i;
+
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    if (threads > STREAM_MAX_THREADS)
+    {
+        threads = STREAM_MAX_THREADS;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.in = in;
+    s.out = out;
+    s.key = key;
+    s.decrypting = decrypting;
+    s.head = head;
+    s.head_size = head_size;
+    s.slots = 2 * threads + 2;
+
+    s.ring = calloc(s.slots, sizeof(struct chunk));
+    workers = calloc(threads, sizeof(pthread_t));
+    if (s.ring == NULL || workers == NULL)
+    {
+        free(s.ring);
+        free(workers);
+        return STREAM_MEM_ERROR;
+    }
+
+    for (i = 0; i < s.slots; i++)
+    {
+        s.ring[i].data = malloc(STREAM_CHUNK_SIZE);
+        if (s.ring[i].data == NULL)
+        {
+            s.error = STREAM_MEM_ERROR;
+        }
+    }
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.changed, NULL);
+
+    if (s.error == STREAM_OK)
+    {
+        read_started = pthread_create(&read_thread, NULL, reader, &s) == 0;
+        for (started = 0; read_started && started < threads; started++)
+        {
+            if (pthread_create(&workers[started], NULL, worker, &s) != 0)
+            {
+                break;
+            }
+        }
+        if (!read_started || started == 0)
+        {
+            set_error(&s, STREAM_MEM_ERROR);
+        }
+    }
+
+    writer(&s);
+
+    if (read_started)
+    {
+        pthread_join(read_thread, NULL);
+    }
+    while (started > 0)
+    {
+        pthread_join(workers[--started], NULL);
+    }
+
+    if (s.error == STREAM_OK && fflush(out) != 0)
+    {
+        s.error = STREAM_WRITE_ERROR;
+    }
+
+    pthread_cond_destroy(&s.changed);
+    pthread_mutex_destroy(&s.lock);
+    for (i = 0; i < s.slots; i++)
+    {
+        free(s.ring[i].data);
+    }
+    free(s.ring);
+    free(workers);
+    return s.error;
+}
@@ -0,0 +1,32 @@
+/*
+ * stream.h - Header file
+ * Crypt or decrypt stream in parallel. Reader splits the input into
+ * sequence-numbered chunks, worker threads cipher them and the chunks are
+ * written out in the order of their sequence numbers.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define STREAM_OK          0
+#define STREAM_READ_ERROR  1
+#define STREAM_WRITE_ERROR 2
+#define STREAM_MEM_ERROR   3
+
+#define STREAM_MAX_THREADS 64
+
+/*
+ * Crypt or decrypt stream by XXTEA in 512B blocks. When crypting, the last
+ * partial block is padded by '0' characters, when decrypting, it is dropped.
+ * Params:
+ *   in         - input stream, read until its end
+ *   out        - output stream
+ *   key        - 128b key
+ *   decrypting - nonzero to decrypt, zero to crypt
+ *   threads    - number of worker threads, clamped to 1..STREAM_MAX_THREADS
+ *   head       - data already read from the input, may be NULL
+ *   head_size  - length of head, at most 512B
+ * Returns STREAM_OK on success, error code otherwise.
+ */
+int cipher_stream(FILE *in, FILE *out, uint32_t *key, int decrypting, int threads,
+                  const uint8_t *head, size_t head_size);
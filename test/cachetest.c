@@ -0,0 +1,119 @@
+/*
+ * cachetest.c - Source file
+ * Stress test of the shared block cache. Several processes look up and insert
+ * a few blocks into a single set, so slots are rewritten under the readers.
+ * A hit must return the right block, a miss must leave the buffer untouched.
+ */
+
+#include "blockcache.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define PROCS 6
+#define TAGS 32
+#define ROUNDS 200000
+#define SENTINEL 0xA5
+
+void fill_block(uint8_t *block, uint64_t index)
+{
+    int i;
+
+    for (i = 0; i < CACHE_BLOCK_SIZE; i++)
+    {
+        block[i] = (uint8_t) (index * 31 + i);
+    }
+}
+
+/*
+ * Returns 0 when all lookups were consistent and some of them hit.
+ */
+int run_worker(struct block_cache *cache, unsigned seed)
+{
+    uint8_t block[CACHE_BLOCK_SIZE];
+    uint8_t expected[CACHE_BLOCK_SIZE];
+    uint8_t sentinel[CACHE_BLOCK_SIZE];
+    struct cache_tag tag;
+    long hits = 0;
+    long errors = 0;
+    long r;
+
+    memset(sentinel, SENTINEL, CACHE_BLOCK_SIZE);
+    memset(&tag, 0, sizeof(tag));
+    tag.dev = 1;
+    tag.ino = 2;
+    tag.mtime = 3;
+    tag.key_id = 4;
+    srand(seed);
+
+    for (r = 0; r < ROUNDS; r++)
+    {
+        tag.index = rand() % TAGS;
+        fill_block(expected, tag.index);
+        memset(block, SENTINEL, CACHE_BLOCK_SIZE);
+
+        if (cache_lookup(cache, &tag, block))
+        {
+            hits++;
+            errors += memcmp(block, expected, CACHE_BLOCK_SIZE) != 0;
+        }
+        else
+        {
+            errors += memcmp(block, sentinel, CACHE_BLOCK_SIZE) != 0;
+            cache_insert(cache, &tag, expected);
+        }
+    }
+
+    if (errors > 0 || hits == 0)
+    {
+        fprintf(stderr, "cachetest: %ld corrupted blocks, %ld hits\n", errors, hits);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    struct block_cache *cache;
+    pid_t pid;
+    int status;
+    int failed = 0;
+    int i;
+
+    cache = cache_create(1);
+    if (cache == NULL)
+    {
+        fprintf(stderr, "cachetest: cache can't be created\n");
+        return 1;
+    }
+
+    for (i = 0; i < PROCS; i++)
+    {
+        pid = fork();
+        if (pid < 0)
+        {
+            fprintf(stderr, "cachetest: fork failed\n");
+            failed = 1;
+            break;
+        }
+        if (pid == 0)
+        {
+            _exit(run_worker(cache, i + 1));
+        }
+    }
+
+    while (wait(&status) > 0)
+    {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            failed = 1;
+        }
+    }
+
+    cache_close(cache);
+    return failed;
+}
@@ -0,0 +1,145 @@
+/*
+ * kerneltest.c - Source file
+ * Compare optimized cipher kernels with the plain XXTEA reference for
+ * various block lengths and numbers of blocks.
+ */
+
+#include "crypto.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_LEN 300
+#define MAX_COUNT 5
+
+/*
+ * Reference decryption, the original straightforward implementation.
+ */
+void ref_decrypt(uint32_t *block, uint32_t len, uint32_t *key)
+{
+    uint32_t z=block[len-1], y=block[0], sum=0, e, DELTA=0x9e3779b9;
+    int32_t p, q;
+
+    q = 6 + 52/len;
+    sum = q*DELTA ;
+    while (sum != 0) {
+        e = (sum >> 2) & 3;
+        for (p=len-1; p>0; p--)
+        {
+            z = block[p-1];
+            block[p] -= (z>>5^y<<2) + (y>>3^z<<4)^(sum^y) + (key[p&3^e]^z);
+            y = block[p];
+        }
+        z = block[len-1];
+        block[0] -= (z>>5^y<<2) + (y>>3^z<<4)^(sum^y) + (key[p&3^e]^z);
+        y =  block[0];
+        sum -= DELTA;
+    }
+}
+
+/*
+ * Reference encryption, the original straightforward implementation.
+ */
+void ref_crypt(uint32_t *block, uint32_t len, uint32_t *key)
+{
+    uint32_t z=block[len-1], y=block[0], sum=0, e, DELTA=0x9e3779b9;
+    int32_t p, q;
+
+    q = 6 + 52/len;
+    while (q-- > 0) {
+        sum += DELTA;
+        e = (sum >> 2) & 3;
+        for (p=0; p<len-1; p++)
+        {
+            y = block[p+1];
+            block[p] += (z>>5^y<<2) + (y>>3^z<<4)^(sum^y) + (key[p&3^e]^z);
+            z = block[p];
+        }
+        y = block[0];
+        block[len-1] += (z>>5^y<<2) + (y>>3^z<<4)^(sum^y) + (key[p&3^e]^z);
+        z = block[len-1];
+    }
+}
+
+int main(void)
+{
+    uint32_t key[4] = {0xABCDEF01, 0xDEEDBEEF, 0x01234567, 0x89ABCDEF};
+    uint32_t *input, *expected, *actual;
+    uint32_t len, count, i;
+    size_t size;
+    int failed = 0;
+
+    size = MAX_LEN * MAX_COUNT * sizeof(uint32_t);
+    input = malloc(size);
+    expected = malloc(size);
+    actual = malloc(size);
+    if (input == NULL || expected == NULL || actual == NULL)
+    {
+        fprintf(stderr, "kerneltest: out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < MAX_LEN * MAX_COUNT; i++)
+    {
+        input[i] = i * 2654435761u ^ 0x5bd1e995;
+    }
+
+    for (len = 1; len <= MAX_LEN; len++)
+    {
+        size = len * sizeof(uint32_t);
+
+        memcpy(expected, input, size);
+        memcpy(actual, input, size);
+        ref_decrypt(expected, len, key);
+        decrypt(actual, len, key);
+        if (memcmp(expected, actual, size) != 0)
+        {
+            fprintf(stderr, "kerneltest: decrypt differs for length %u\n", len);
+            failed = 1;
+        }
+
+        // XXTEA is defined for 2 words at least, single word can't be inverted
+        crypt(actual, len, key);
+        if (len >= 2 && memcmp(input, actual, size) != 0)
+        {
+            fprintf(stderr, "kerneltest: crypt does not invert decrypt for length %u\n", len);
+            failed = 1;
+        }
+
+        for (count = 0; count <= MAX_COUNT; count++)
+        {
+            memcpy(expected, input, count * size);
+            memcpy(actual, input, count * size);
+            for (i = 0; i < count; i++)
+            {
+                ref_decrypt(expected + i * len, len, key);
+            }
+            decrypt_blocks(actual, len, count, key);
+            if (memcmp(expected, actual, count * size) != 0)
+            {
+                fprintf(stderr, "kerneltest: decrypt_blocks differs for length %u, %u blocks\n", len, count);
+                failed = 1;
+            }
+
+            memcpy(expected, input, count * size);
+            memcpy(actual, input, count * size);
+            for (i = 0; i < count; i++)
+            {
+                ref_crypt(expected + i * len, len, key);
+            }
+            crypt_blocks(actual, len, count, key);
+            if (memcmp(expected, actual, count * size) != 0)
+            {
+                fprintf(stderr, "kerneltest: crypt_blocks differs for length %u, %u blocks\n", len, count);
+                failed = 1;
+            }
+        }
+    }
+
+    free(input);
+    free(expected);
+    free(actual);
+    return failed;
+}
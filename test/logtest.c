@@ -0,0 +1,506 @@
+/*
+ * logtest.c - Source file
+ * Test driver of the encrypted append-only log.
+ *   logtest write <log> <key file>    - append from several threads, reopen, append
+ *                                       again and fill the last block up to edge offsets
+ *   logtest recover <log> <key file>  - append garbage and truncate the log in the middle
+ *                                       of a record, reopen and append again each time
+ *   logtest verify <decrypted log>    - check records of the log decrypted by xxtea -d
+ *   logtest wrongkey <log> <key file> - check the log can't be opened with the key
+ */
+
+#include "cryptlog.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define THREADS 4
+#define ROUNDS 500
+#define LOST_ID 8
+#define SINGLE_ID 9
+#define RECOVERED 4
+#define BLOCK 512
+#define HEADER 4
+#define FRAME 4
+#define NO_FRAME 0xFFFF
+#define MAGIC 0x4C47
+#define REC_CAP 1024
+
+/*
+ * Offsets in the last block the log is made to end at. Ends within the last
+ * FRAME bytes of a block force the next frame into the next block.
+ */
+static const int edges[] = { 505, 508, 509, 511, 0, 5 };
+#define EDGES_COUNT (sizeof(edges) / sizeof(edges[0]))
+
+static struct cryptlog *wr;
+static int failed = 0;
+static int first_seq = 0;
+
+int read_key(char *keyfile, uint32_t *key)
+{
+    char s_key[33];
+    char s_part[9];
+    FILE *f;
+    int i;
+
+    f = fopen(keyfile, "r");
+    if (f == NULL || fgets(s_key, sizeof(s_key), f) == NULL || strlen(s_key) != 32)
+    {
+        fprintf(stderr, "logtest: invalid key file '%s'\n", keyfile);
+        if (f != NULL)
+        {
+            fclose(f);
+        }
+        return 1;
+    }
+    fclose(f);
+
+    for (i = 0; i < 4; i++)
+    {
+        memcpy(s_part, s_key + i * 8, 8);
+        s_part[8] = '\0';
+        key[i] = (uint32_t) strtoul(s_part, NULL, 16);
+    }
+    return 0;
+}
+
+/*
+ * Record is "<id> <seq> " followed by fill character of the writer.
+ */
+uint32_t make_record(char *rec, int id, int seq, uint32_t len)
+{
+    int n = sprintf(rec, "%d %d ", id, seq);
+
+    if (len < (uint32_t) n)
+    {
+        len = n;
+    }
+    memset(rec + n, 'a' + id, len - n);
+    return len;
+}
+
+/*
+ * Log position of the frame header following position pos.
+ */
+uint64_t frame_start(uint64_t pos)
+{
+    if (pos % BLOCK < HEADER)
+    {
+        return pos - pos % BLOCK + HEADER;
+    }
+    if (BLOCK - pos % BLOCK < FRAME)
+    {
+        return pos - pos % BLOCK + BLOCK + HEADER;
+    }
+    return pos;
+}
+
+/*
+ * Log position after record of len bytes appended at pos, every block
+ * starts with its header.
+ */
+uint64_t record_end(uint64_t pos, uint32_t len)
+{
+    pos = frame_start(pos) + FRAME;
+    while (len > 0)
+    {
+        if (pos % BLOCK == 0)
+        {
+            pos += HEADER;
+        }
+        pos++;
+        len--;
+    }
+    return pos;
+}
+
+int append(int id, int seq, uint32_t len, int commit, uint64_t *lsn)
+{
+    char rec[REC_CAP];
+    uint64_t pos;
+
+    len = make_record(rec, id, seq, len);
+    if (cryptlog_append(wr, rec, len, &pos) != 0 || (commit && cryptlog_commit(wr, pos) != 0))
+    {
+        fprintf(stderr, "logtest: append of record %d/%d failed\n", id, seq);
+        failed = 1;
+        return 1;
+    }
+    if (lsn != NULL)
+    {
+        *lsn = pos;
+    }
+    return 0;
+}
+
+void *appender(void *arg)
+{
+    int id = (int) (intptr_t) arg;
+    int i;
+
+    for (i = 0; i < ROUNDS; i++)
+    {
+        append(id, first_seq + i, 10 + (i * 37 + id * 11) % 200, i % 3 == 0, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * Every writer appends ROUNDS records numbered from first.
+ */
+int append_threads(int first)
+{
+    pthread_t t[THREADS];
+    long i;
+
+    first_seq = first;
+    for (i = 0; i < THREADS; i++)
+    {
+        pthread_create(&t[i], NULL, appender, (void *) (intptr_t) i);
+    }
+    for (i = 0; i < THREADS; i++)
+    {
+        pthread_join(t[i], NULL);
+    }
+    return failed;
+}
+
+int reopen(char *path, uint32_t *key)
+{
+    if (wr != NULL && cryptlog_close(wr) != 0)
+    {
+        fprintf(stderr, "logtest: close failed\n");
+        return 1;
+    }
+    wr = cryptlog_open(path, key);
+    if (wr == NULL)
+    {
+        fprintf(stderr, "logtest: open of '%s' failed\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+int write_log(char *path, char *keyfile)
+{
+    uint32_t key[4];
+    uint64_t lsn = 0;
+    uint32_t len;
+    int seq = 0;
+    unsigned i;
+
+    if (read_key(keyfile, key) != 0 || reopen(path, key) != 0 || append_threads(0) != 0)
+    {
+        return 1;
+    }
+
+    if (reopen(path, key) != 0 || append_threads(ROUNDS) != 0)
+    {
+        return 1;
+    }
+
+    for (i = 0; i < EDGES_COUNT && !failed; i++)
+    {
+        if (append(SINGLE_ID, seq++, 20, 1, &lsn) != 0)
+        {
+            return 1;
+        }
+
+        for (len = 16; record_end(lsn, len) % BLOCK != (uint64_t) edges[i]; len++)
+            ;
+
+        if (append(SINGLE_ID, seq++, len, 1, &lsn) != 0)
+        {
+            return 1;
+        }
+        if (lsn % BLOCK != (uint64_t) edges[i])
+        {
+            fprintf(stderr, "logtest: log ends at %u, not at %d\n", (unsigned) (lsn % BLOCK), edges[i]);
+            return 1;
+        }
+
+        if (reopen(path, key) != 0)
+        {
+            return 1;
+        }
+    }
+
+    append(SINGLE_ID, seq++, 30, 0, NULL);
+    if (cryptlog_close(wr) != 0)
+    {
+        fprintf(stderr, "logtest: close failed\n");
+        return 1;
+    }
+    return failed;
+}
+
+int append_raw(char *path, size_t size)
+{
+    FILE *f = fopen(path, "ab");
+    size_t i;
+
+    for (i = 0; f != NULL && i < size; i++)
+    {
+        fputc(0, f);
+    }
+    if (f == NULL || fclose(f) != 0)
+    {
+        fprintf(stderr, "logtest: can't append to '%s'\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Log written by write mode is damaged the way a crash could leave it, each
+ * time it must be opened again with whole records kept and appendable.
+ */
+int recover_log(char *path, char *keyfile)
+{
+    uint32_t key[4];
+    uint64_t start, end, cut;
+    uint32_t len;
+    int seq = 2 * EDGES_COUNT + 1;
+
+    // log ending at block boundary, no padding separates it from the garbage
+    if (read_key(keyfile, key) != 0 || reopen(path, key) != 0
+        || append(SINGLE_ID, seq++, 20, 1, &end) != 0)
+    {
+        return 1;
+    }
+    for (len = 16; record_end(end, len) % BLOCK != 0; len++)
+        ;
+    if (append(SINGLE_ID, seq++, len, 1, NULL) != 0 || cryptlog_close(wr) != 0)
+    {
+        fprintf(stderr, "logtest: close failed\n");
+        return 1;
+    }
+    wr = NULL;
+
+    // block which was never written and a torn extension of the file
+    if (append_raw(path, BLOCK + 100) != 0 || reopen(path, key) != 0
+        || append(SINGLE_ID, seq++, 40, 1, &start) != 0)
+    {
+        return 1;
+    }
+
+    // record crossing block boundaries is cut at the boundary inside it
+    if (append(LOST_ID, 0, 1000, 1, &end) != 0 || cryptlog_close(wr) != 0)
+    {
+        fprintf(stderr, "logtest: close failed\n");
+        return 1;
+    }
+    wr = NULL;
+    cut = (end - 1) / BLOCK * BLOCK;
+    if (cut <= start || truncate(path, cut) != 0)
+    {
+        fprintf(stderr, "logtest: can't truncate '%s' at %lu\n", path, (unsigned long) cut);
+        return 1;
+    }
+
+    if (reopen(path, key) != 0 || append(SINGLE_ID, seq++, 40, 1, &end) != 0)
+    {
+        return 1;
+    }
+    if (end != record_end(start, 40))
+    {
+        fprintf(stderr, "logtest: record appended at wrong position after recovery\n");
+        return 1;
+    }
+    if (cryptlog_close(wr) != 0)
+    {
+        fprintf(stderr, "logtest: close failed\n");
+        return 1;
+    }
+    return failed;
+}
+
+int verify_log(char *path)
+{
+    FILE *f;
+    uint8_t *data;
+    uint64_t size, pos, blocks, b;
+    uint32_t len, i;
+    uint16_t first, check;
+    int *firsts;
+    char rec[REC_CAP + 1];
+    int counts[SINGLE_ID + 1] = {0};
+    int id, seq, n;
+
+    f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "logtest: no file '%s'\n", path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    blocks = size / BLOCK;
+    data = malloc(size);
+    firsts = malloc(blocks * sizeof(int));
+    if (data == NULL || firsts == NULL || fread(data, 1, size, f) != size || size % BLOCK != 0)
+    {
+        fprintf(stderr, "logtest: can't read '%s'\n", path);
+        fclose(f);
+        free(data);
+        free(firsts);
+        return 1;
+    }
+    fclose(f);
+
+    for (b = 0; b < blocks; b++)
+    {
+        firsts[b] = NO_FRAME;
+    }
+
+    pos = 0;
+    for (;;)
+    {
+        pos = frame_start(pos);
+        if (pos >= size)
+        {
+            break;
+        }
+        memcpy(&len, data + pos, FRAME);
+        if (len == 0)
+        {
+            break;
+        }
+        if (len > REC_CAP || record_end(pos, len) > size)
+        {
+            fprintf(stderr, "logtest: bad frame at %lu\n", (unsigned long) pos);
+            free(data);
+            free(firsts);
+            return 1;
+        }
+        if (firsts[pos / BLOCK] == NO_FRAME)
+        {
+            firsts[pos / BLOCK] = pos % BLOCK;
+        }
+
+        // gather the record skipping block headers
+        pos += FRAME;
+        for (i = 0; i < len; i++, pos++)
+        {
+            if (pos % BLOCK == 0)
+            {
+                pos += HEADER;
+            }
+            rec[i] = data[pos];
+        }
+        rec[len] = '\0';
+
+        if (sscanf(rec, "%d %d %n", &id, &seq, &n) != 2
+            || id < 0 || id > SINGLE_ID || seq != counts[id])
+        {
+            fprintf(stderr, "logtest: unexpected record before %lu\n", (unsigned long) pos);
+            free(data);
+            free(firsts);
+            return 1;
+        }
+        for (i = n; i < len; i++)
+        {
+            if (rec[i] != 'a' + id)
+            {
+                fprintf(stderr, "logtest: corrupted record %d/%d\n", id, seq);
+                free(data);
+                free(firsts);
+                return 1;
+            }
+        }
+        counts[id]++;
+    }
+
+    // the last block is padded by zeros
+    for (; pos < size; pos++)
+    {
+        if (pos % BLOCK >= HEADER && data[pos] != 0)
+        {
+            fprintf(stderr, "logtest: garbage after the last record at %lu\n", (unsigned long) pos);
+            free(data);
+            free(firsts);
+            return 1;
+        }
+    }
+
+    for (b = 0; b < blocks; b++)
+    {
+        memcpy(&first, data + b * BLOCK, sizeof(first));
+        memcpy(&check, data + b * BLOCK + sizeof(first), sizeof(check));
+        if (check != (uint16_t) (MAGIC ^ b) || first != firsts[b])
+        {
+            fprintf(stderr, "logtest: bad header of block %lu\n", (unsigned long) b);
+            free(data);
+            free(firsts);
+            return 1;
+        }
+    }
+    free(data);
+    free(firsts);
+
+    for (id = 0; id < THREADS; id++)
+    {
+        if (counts[id] != 2 * ROUNDS)
+        {
+            fprintf(stderr, "logtest: %d records of writer %d, expected %d\n", counts[id], id, 2 * ROUNDS);
+            return 1;
+        }
+    }
+    if (counts[LOST_ID] != 0)
+    {
+        fprintf(stderr, "logtest: truncated record survived recovery\n");
+        return 1;
+    }
+    if (counts[SINGLE_ID] != 2 * (int) EDGES_COUNT + 1 + RECOVERED)
+    {
+        fprintf(stderr, "logtest: %d single records, expected %d\n", counts[SINGLE_ID], 2 * (int) EDGES_COUNT + 1 + RECOVERED);
+        return 1;
+    }
+    return 0;
+}
+
+int wrong_key(char *path, char *keyfile)
+{
+    uint32_t key[4];
+
+    if (read_key(keyfile, key) != 0)
+    {
+        return 1;
+    }
+    wr = cryptlog_open(path, key);
+    if (wr != NULL)
+    {
+        fprintf(stderr, "logtest: log opened with wrong key\n");
+        cryptlog_close(wr);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && strcmp(argv[1], "write") == 0)
+    {
+        return write_log(argv[2], argv[3]);
+    }
+    if (argc == 4 && strcmp(argv[1], "recover") == 0)
+    {
+        return recover_log(argv[2], argv[3]);
+    }
+    if (argc == 3 && strcmp(argv[1], "verify") == 0)
+    {
+        return verify_log(argv[2]);
+    }
+    if (argc == 4 && strcmp(argv[1], "wrongkey") == 0)
+    {
+        return wrong_key(argv[2], argv[3]);
+    }
+    fprintf(stderr, "Usage: %s write <log> <key file> | recover <log> <key file> | verify <decrypted log> | wrongkey <log> <key file>\n", argv[0]);
+    return 1;
+}
@@ -9,6 +9,8 @@
  */
 
 #include "crypto.h"
+#include "blockcache.h"
+#include "stream.h"
 
 #include <stdint.h>
 #include <unistd.h>
@@ -17,17 +19,37 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 int print_help(const char *prog)
 {
-    fprintf(stderr, "Usage: %s [ -h | -c | -d ] [ -i <input file> ] [ -o <output file> ] [ -k <key file> ]\n", prog);
+    fprintf(stderr, "Usage: %s [ -h | -c | -d ] [ -i <input file> ] [ -o <output file> ] [ -k <key file> ] [ -m <cache name> ] [ -v ] [ -j <threads> ]\n", prog);
+    fprintf(stderr, "       %s -r <cache name>\n", prog);
+    fprintf(stderr, "       %s -w <keyring file> -i <input file>\n", prog);
     fprintf(stderr, "Crypt and decrypt file by XXTEA cipher. Input file is padded to 512B boundary.\n");
     fprintf(stderr, "Key file must contain exactly 32 hexadecimal characters.\n");
+    fprintf(stderr, "Input or output file '-' stands for standard input or output.\n");
+    fprintf(stderr, "Option -j ciphers chunks of input by given number of threads (1 to %d, default is the number\n", STREAM_MAX_THREADS);
+    fprintf(stderr, "of online processors), output keeps the input order.\n");
+    fprintf(stderr, "Option -v stores key check value into crypted file, decryption with wrong key then fails at once.\n");
+    fprintf(stderr, "Option -w prints keys from keyring (one key per line) matching the key check value of the input file.\n");
+    fprintf(stderr, "Option -m shares decrypted blocks with other processes using the same cache name.\n");
+    fprintf(stderr, "The cache holds decrypted data in shared memory (tmpfs) even after all processes exit,\n");
+    fprintf(stderr, "so anyone with access to it can read the plain data. Remove it by option -r when done.\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "* Crypt file in.bin to file out.bin with key file key.txt:\n");
     fprintf(stderr, "  $ %s -c -i in.bin -o out.bin -k key.txt\n", prog);
     fprintf(stderr, "* Decrypt file in.bin to file out.bin with key file key.txt:\n");
     fprintf(stderr, "  $ %s -d -i in.bin -o out.bin -k key.txt\n", prog);
+    fprintf(stderr, "* Crypt output of dump command by 4 threads into file out.bin:\n");
+    fprintf(stderr, "  $ dump | %s -c -j 4 -i - -o out.bin -k key.txt\n", prog);
+    fprintf(stderr, "* Find key of file in.bin among keys in keyring.txt:\n");
+    fprintf(stderr, "  $ %s -w keyring.txt -i in.bin\n", prog);
+    fprintf(stderr, "* Decrypt file in.bin to file out.bin, reuse blocks decrypted by other workers:\n");
+    fprintf(stderr, "  $ %s -d -i in.bin -o out.bin -k key.txt -m /xxtea-cache\n", prog);
+    fprintf(stderr, "* Remove the cache with decrypted blocks:\n");
+    fprintf(stderr, "  $ %s -r /xxtea-cache\n", prog);
     
     return 0;
 }
@@ -56,11 +78,18 @@ uint32_t parse_key_part(char *s_key, size_t offset)
 
 #define KEY_PARTS_COUNT 4
 
+void parse_key(char *s_key, uint32_t *key)
+{
+    int i;
+
+    for(i = 0; i < KEY_PARTS_COUNT; ++i)
+        key[i] = parse_key_part(s_key, i * S_PART_LEN);
+}
+
 int read_key(char *keyfile, uint32_t *key)
 {
     char s_key [S_KEY_CAP];
     FILE * f;
-    int i;
 
     f = fopen (keyfile, "r");
     if(f == NULL) {
@@ -70,8 +99,7 @@ int read_key(char *keyfile, uint32_t *key)
     
     if ((fgets(s_key, S_KEY_CAP, f) != NULL) && strlen(s_key) == S_KEY_LEN)
     {
-        for(i = 0; i < KEY_PARTS_COUNT; ++i)
-            key[i] = parse_key_part(s_key, i * S_PART_LEN);
+        parse_key(s_key, key);
         
         fclose(f);
         return 0;
@@ -87,109 +115,332 @@ int read_key(char *keyfile, uint32_t *key)
 
 #define BLOCK_SIZE 512
 #define CRYPT_ATONCE_SIZE 128
+#define CACHE_SETS 1024
+
+#define HEADER_MAGIC "XXTEAKCV"
+#define HEADER_MAGIC_LEN 8
+
+/*
+ * Key check value, obtained by ciphering zero 64b block.
+ * It identifies the key without revealing it, so it is stored in the file
+ * header and used as the key ID of the shared cache.
+ */
+uint64_t key_check_value(uint32_t *key)
+{
+    uint32_t v[2] = {0, 0};
+
+    crypt(v, 2, key);
+    return ((uint64_t) v[0] << 32) | v[1];
+}
+
+/*
+ * Header is the plain first block of the file: magic followed by the key
+ * check value, the rest is zero. Files without header are decrypted unchecked.
+ */
+void make_header(uint8_t *block, uint32_t *key)
+{
+    uint64_t kcv = key_check_value(key);
+
+    memset(block, 0, BLOCK_SIZE);
+    memcpy(block, HEADER_MAGIC, HEADER_MAGIC_LEN);
+    memcpy(block + HEADER_MAGIC_LEN, &kcv, sizeof(kcv));
+}
+
+int is_header(uint8_t *block)
+{
+    return memcmp(block, HEADER_MAGIC, HEADER_MAGIC_LEN) == 0;
+}
 
-int crypt_file(char *infile, char *outfile, char *keyfile)
+uint64_t header_check_value(uint8_t *block)
+{
+    uint64_t kcv;
+
+    memcpy(&kcv, block + HEADER_MAGIC_LEN, sizeof(kcv));
+    return kcv;
+}
+
+/*
+ * Open file, name "-" stands for standard input or output.
+ */
+FILE *open_file(char *name, const char *mode, FILE *std)
+{
+    if (strcmp(name, "-") == 0)
+    {
+        return std;
+    }
+    return fopen(name, mode);
+}
+
+void close_file(FILE *f)
+{
+    if (f != stdin && f != stdout)
+    {
+        fclose(f);
+    }
+}
+
+int stream_error(int rc, char *infile, char *outfile)
+{
+    switch (rc)
+    {
+        case STREAM_OK:
+            return 0;
+        
+        case STREAM_READ_ERROR:
+            fprintf(stderr, "Error while reading from '%s'.\n", infile);
+            return 1;
+        
+        case STREAM_WRITE_ERROR:
+            fprintf(stderr, "Error while writing into '%s'.\n", outfile);
+            return 1;
+        
+        default:
+            fprintf(stderr, "Not enough resources to cipher '%s'.\n", infile);
+            return 1;
+    }
+}
+
+int crypt_file(char *infile, char *outfile, char *keyfile, int check, int threads)
 {
     FILE * f;
     FILE * of;
     uint32_t key[KEY_PARTS_COUNT] = {0,0,0,0};
     uint8_t block[BLOCK_SIZE];
-    int size;
-    int last = 0;
+    int rc;
     
     if (read_key(keyfile, key) != 0)
     {
         return 1;
     }
     
-    f = fopen (infile, "rb");
+    f = open_file(infile, "rb", stdin);
     if(f == NULL) {
         fprintf(stderr, "No input file '%s' found.\n", infile);
         return 1;
     }
     
-    of = fopen (outfile, "wb");
+    of = open_file(outfile, "wb", stdout);
     if(of == NULL) {
         fprintf(stderr, "Output file '%s' can't be created.\n", outfile);
-        fclose(f);
+        close_file(f);
         return 1;
     }
     
-    while ((size = fread(block, sizeof(uint8_t), BLOCK_SIZE, f)) == BLOCK_SIZE || (size > 0 && feof(f) && !last))
+    if (check)
     {
-        int i = 0;
-        for (i = size; i < BLOCK_SIZE; i++)
-        {
-            block[i] = '0';
-        }
-        
-        crypt((uint32_t *)block, CRYPT_ATONCE_SIZE, key);
-        
-        if (size < BLOCK_SIZE)
-        {
-            last = 1;
-        }
-        
-        size = fwrite(block, sizeof(uint8_t), BLOCK_SIZE, of);
-        if (size < BLOCK_SIZE)
+        make_header(block, key);
+        if (fwrite(block, sizeof(uint8_t), BLOCK_SIZE, of) < BLOCK_SIZE)
         {
             fprintf(stderr, "Error while writing into '%s'.\n", outfile);
-            fclose(f);
-            fclose(of);
+            close_file(f);
+            close_file(of);
             return 1;
-        }        
+        }
     }
     
-    fclose(f);
-    fclose(of);
-    return 0;
+    rc = cipher_stream(f, of, key, 0, threads, NULL, 0);
+    
+    close_file(f);
+    close_file(of);
+    return stream_error(rc, infile, outfile);
 }
 
-int decrypt_file(char *infile, char *outfile, char *keyfile)
+int decrypt_file(char *infile, char *outfile, char *keyfile, char *cachename, int threads)
 {
     FILE * f;
     FILE * of;
     uint32_t key[KEY_PARTS_COUNT] = {0,0,0,0};
     uint8_t block[BLOCK_SIZE];
     int size;
+    int rc;
+    struct block_cache *cache = NULL;
+    struct cache_tag tag;
+    struct stat st;
     
     if (read_key(keyfile, key) != 0)
     {
         return 1;
     }
     
-    f = fopen (infile, "rb");
+    f = open_file(infile, "rb", stdin);
     if(f == NULL) {
         fprintf(stderr, "No input file '%s' found.\n", infile);
         return 1;
     }
     
-    of = fopen (outfile, "wb");
+    // wrong key is refused before the output file is touched
+    size = fread(block, sizeof(uint8_t), BLOCK_SIZE, f);
+    if (size == BLOCK_SIZE && is_header(block))
+    {
+        if (header_check_value(block) != key_check_value(key))
+        {
+            fprintf(stderr, "Key file '%s' does not match input file '%s'.\n", keyfile, infile);
+            close_file(f);
+            return 1;
+        }
+        size = fread(block, sizeof(uint8_t), BLOCK_SIZE, f);
+    }
+    
+    of = open_file(outfile, "wb", stdout);
     if(of == NULL) {
         fprintf(stderr, "Output file '%s' can't be created.\n", outfile);
-        fclose(f);
+        close_file(f);
         return 1;
     }
     
-    while ((size = fread(block, sizeof(uint8_t), BLOCK_SIZE, f)) == BLOCK_SIZE)
+    if (cachename != NULL)
+    {
+        cache = cache_open(cachename, CACHE_SETS);
+        if (cache == NULL || fstat(fileno(f), &st) != 0)
+        {
+            fprintf(stderr, "Cache '%s' can't be opened, decrypting without it.\n", cachename);
+            if (cache != NULL)
+            {
+                cache_close(cache);
+                cache = NULL;
+            }
+        }
+        else
+        {
+            memset(&tag, 0, sizeof(tag));
+            tag.dev    = st.st_dev;
+            tag.ino    = st.st_ino;
+            tag.mtime  = (uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+            tag.key_id = key_check_value(key);
+        }
+    }
+    
+    // the block read ahead is handed over to the stream
+    if (cache == NULL)
+    {
+        rc = cipher_stream(f, of, key, 1, threads, block, size);
+        close_file(f);
+        close_file(of);
+        return stream_error(rc, infile, outfile);
+    }
+    
+    while (size == BLOCK_SIZE)
     {      
-        decrypt((uint32_t *)block, CRYPT_ATONCE_SIZE, key);
+        if (!cache_lookup(cache, &tag, block))
+        {
+            decrypt((uint32_t *)block, CRYPT_ATONCE_SIZE, key);
+            cache_insert(cache, &tag, block);
+        }
+        tag.index++;
                 
         size = fwrite(block, sizeof(uint8_t), BLOCK_SIZE, of);
         if (size < BLOCK_SIZE)
         {
             fprintf(stderr, "Error while writing into '%s'.\n", outfile);
-            fclose(f);
-            fclose(of);
+            cache_close(cache);
+            close_file(f);
+            close_file(of);
             return 1;
         }        
+        
+        size = fread(block, sizeof(uint8_t), BLOCK_SIZE, f);
+    }
+    
+    cache_close(cache);
+    close_file(f);
+    close_file(of);
+    return 0;
+}
+
+#define S_LINE_CAP 256
+
+int which_key(char *infile, char *keyring)
+{
+    FILE * f;
+    uint32_t key[KEY_PARTS_COUNT] = {0,0,0,0};
+    uint8_t block[BLOCK_SIZE];
+    char s_line [S_LINE_CAP];
+    uint64_t kcv;
+    int line = 0;
+    int found = 0;
+    
+    f = open_file(infile, "rb", stdin);
+    if(f == NULL) {
+        fprintf(stderr, "No input file '%s' found.\n", infile);
+        return 1;
+    }
+    
+    if (fread(block, sizeof(uint8_t), BLOCK_SIZE, f) != BLOCK_SIZE || !is_header(block))
+    {
+        fprintf(stderr, "Input file '%s' has no key check value.\n", infile);
+        close_file(f);
+        return 1;
+    }
+    close_file(f);
+    kcv = header_check_value(block);
+    
+    f = fopen (keyring, "r");
+    if(f == NULL) {
+        fprintf(stderr, "No keyring file '%s' found.\n", keyring);
+        return 1;
+    }
+    
+    while (fgets(s_line, S_LINE_CAP, f) != NULL)
+    {
+        line++;
+        s_line[strcspn(s_line, "\r\n")] = '\0';
+        if (strlen(s_line) != S_KEY_LEN)
+        {
+            if (s_line[0] != '\0')
+            {
+                fprintf(stderr, "Line %d of keyring '%s' is not a valid key.\n", line, keyring);
+            }
+            continue;
+        }
+        
+        parse_key(s_line, key);
+        if (key_check_value(key) == kcv)
+        {
+            printf("%d: %s\n", line, s_line);
+            found = 1;
+        }
     }
     
     fclose(f);
-    fclose(of);
+    if (!found)
+    {
+        fprintf(stderr, "No key in keyring '%s' matches input file '%s'.\n", keyring, infile);
+        return 1;
+    }
     return 0;
 }
 
+/*
+ * Default number of cipher threads, one per online processor.
+ */
+int default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+    {
+        return 1;
+    }
+    return (n > STREAM_MAX_THREADS) ? STREAM_MAX_THREADS : (int) n;
+}
+
+/*
+ * Parse number of threads, whole string must be a number in 1..STREAM_MAX_THREADS.
+ */
+int parse_threads(const char *s)
+{
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || n < 1 || n > STREAM_MAX_THREADS)
+    {
+        return 0;
+    }
+    return (int) n;
+}
+
 int print_error(char * msg, char * prog)
 {
     fprintf(stderr, "%s: %s\n", prog, msg);
@@ -214,10 +465,22 @@ int main(int argc, char **argv)
     char *keyfile     = NULL;
     int keyfile_valid = 0;
     
+    // name of the shared block cache
+    char *cachename = NULL;
+    
+    // store key check value
+    int check = 0;
+    
+    // name of the keyring file
+    char *keyring = NULL;
+    
+    // number of cipher threads
+    int threads = default_threads();
+    
     int opt;
     opterr = 0;
     
-    while((opt = getopt(argc, argv, "hcdi:o:k:")) != -1) 
+    while((opt = getopt(argc, argv, "hcdi:o:k:m:r:vw:j:")) != -1) 
     {
         switch(opt) 
         {
@@ -247,12 +510,56 @@ int main(int argc, char **argv)
                 keyfile_valid = 1;
                 break;
                 
+            case 'm':
+                cachename = optarg;
+                break;
+                
+            case 'r':
+                if (cache_unlink(optarg) != 0)
+                {
+                    fprintf(stderr, "Cache '%s' can't be removed.\n", optarg);
+                    return 1;
+                }
+                return 0;
+                
+            case 'v':
+                check = 1;
+                break;
+                
+            case 'w':
+                keyring = optarg;
+                break;
+                
+            case 'j':
+                threads = parse_threads(optarg);
+                if (threads == 0)
+                {
+                    fprintf(stderr, "%s: Number of threads must be 1 to %d.\n", argv[0], STREAM_MAX_THREADS);
+                    return 1;
+                }
+                break;
+                
             case '?':
             default:
                 return print_opterr(optopt);
         }
     }
     
+    if (keyring != NULL)
+    {
+        if (crypt_valid || decrypt_valid)
+        {
+            return print_error("Option -w can't be used with option -c or -d.", argv[0]);
+        }
+        
+        if (!infile_valid)
+        {
+            return print_error("Input file must be specified.", argv[0]);
+        }
+        
+        return which_key(infile, keyring);
+    }
+    
     if (crypt_valid && decrypt_valid)
     {
         return print_error("Use only option -c or -d, not both of them.", argv[0]);
@@ -278,15 +585,30 @@ int main(int argc, char **argv)
         return print_error("Key file must be specified.", argv[0]);
     }
     
+    if (cachename != NULL && !decrypt_valid)
+    {
+        return print_error("Option -m can be used only with option -d.", argv[0]);
+    }
+    
+    if (cachename != NULL && strcmp(infile, "-") == 0)
+    {
+        return print_error("Option -m can't be used with standard input.", argv[0]);
+    }
+    
+    if (check && !crypt_valid)
+    {
+        return print_error("Option -v can be used only with option -c.", argv[0]);
+    }
+    
     
     if (crypt_valid)
     {
-        return crypt_file(infile, outfile, keyfile);
+        return crypt_file(infile, outfile, keyfile, check, threads);
     }
     
     if (decrypt_valid)
     {
-        return decrypt_file(infile, outfile, keyfile);
+        return decrypt_file(infile, outfile, keyfile, cachename, threads);
     }
     
     return 1;